@@ -22,17 +22,27 @@
 
 */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libmill.h>
+#include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <signal.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "list.h"
@@ -44,11 +54,431 @@
 struct service {
     struct tcpmux_list_item item;
     const char *name;
+    /* CPU the registration is pinned to or -1 if it is not pinned. */
+    int cpu;
     chan ch;
 };
 
 struct tcpmux_list services = {0};
 
+/* How long to wait for an activated service to pick up a connection
+   before giving up on it. In milliseconds. */
+#define TCPMUX_ACTIVATION_TIMEOUT 10000
+
+/* Instance that exits sooner than this after being started is considered
+   to have failed to start. In milliseconds. */
+#define TCPMUX_SPAWN_FAILURE_TIME 1000
+
+/* Delay before restarting an instance that failed to start. It doubles
+   with each consecutive failure up to the maximum. In milliseconds. */
+#define TCPMUX_SPAWN_BACKOFF 100
+#define TCPMUX_SPAWN_BACKOFF_MAX 30000
+
+/* After this many consecutive failures to start an instance, connections
+   for the service are rejected until the next attempt is due. */
+#define TCPMUX_SPAWN_RETRIES 5
+
+/* How long an instance has to exit after SIGTERM before it gets SIGKILL.
+   In milliseconds. */
+#define TCPMUX_KILL_TIMEOUT 5000
+
+enum instance_state {
+    /* The instance gets new connections. */
+    INSTANCE_RUNNING,
+    /* The instance gets no new connections and its registration is closed.
+       It is expected to finish the connections it has and exit. */
+    INSTANCE_DRAINING,
+    /* The instance didn't exit within the drain period and got SIGTERM. */
+    INSTANCE_TERMINATED,
+    /* The instance didn't exit after SIGTERM and got SIGKILL. */
+    INSTANCE_KILLED
+};
+
+/* Process spawned by tcpmuxd to serve an activated service. */
+struct instance {
+    struct tcpmux_list_item item;
+    pid_t pid;
+    int64_t started;
+    enum instance_state state;
+    /* When the instance moves to the next state or -1. */
+    int64_t deadline;
+    /* Wakes up the instance's registration or NULL if it has none. */
+    chan ctl;
+};
+
+/* Service that is started on demand when a connection for it arrives. */
+struct activation {
+    struct tcpmux_list_item item;
+    char *name;
+    /* Command used to start an instance of the service, split into
+       arguments. It is executed directly, not via the shell. */
+    char *command;
+    char **argv;
+    /* Surplus instances are asked to drain after this many milliseconds
+       without a new connection. They have the same amount of time to finish
+       their connections and exit before they get SIGTERM. 0 means that they
+       are never shut down. */
+    int64_t idle;
+    /* Number of instances to keep running even if there are no connections. */
+    int warm;
+    /* Connections waiting to be picked up by one of the instances. All the
+       instances registered for the service read from this channel. */
+    chan ch;
+    /* Wakes up the supervisor when something it cares about changes. */
+    chan wake;
+    int pending;
+    int64_t last;
+    struct tcpmux_list instances;
+    /* Number of instances in INSTANCE_RUNNING state. */
+    int running;
+    /* Number of consecutive instances that failed to start. */
+    int failures;
+    /* No instance is started before this point in time. */
+    int64_t nextspawn;
+};
+
+struct tcpmux_list activations = {0};
+
+/* SIGCHLD handler writes to this pipe to wake up the reaper. */
+static int sigchld_pipe[2] = {-1, -1};
+
+/* Number of connections handed to a CPU-pinned registration running on
+   the CPU that processed the connection's packets vs. on a different one. */
+static uint64_t dispatch_local = 0;
+static uint64_t dispatch_remote = 0;
+
+/* Returns the CPU that processed the most recent packet of the connection
+   or -1 if it is not known. */
+static int incomingcpu(int fd) {
+#if defined SO_INCOMING_CPU
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    int rc = getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len);
+    if(rc == 0 && cpu >= 0)
+        return cpu;
+#endif
+    return -1;
+}
+
+/* Accounts for a connection delivered to a registration pinned to 'cpu'.
+   Connections whose incoming CPU is not known are not counted. */
+static void countdispatch(int cpu, int fd) {
+    if(cpu == -1)
+        return;
+    int incpu = incomingcpu(fd);
+    if(incpu == -1)
+        return;
+    if(incpu == cpu)
+        ++dispatch_local;
+    else
+        ++dispatch_remote;
+}
+
+static struct activation *lookupactivation(struct tcpmux_list *list,
+      const char *name) {
+    struct tcpmux_list_item *it;
+    for(it = tcpmux_list_begin(list); it; it = tcpmux_list_next(it)) {
+        struct activation *act = cont(it, struct activation, item);
+        if(strcmp(name, act->name) == 0)
+            return act;
+    }
+    return NULL;
+}
+
+static struct activation *findactivation(const char *name) {
+    return lookupactivation(&activations, name);
+}
+
+static void freeactivation(struct activation *act) {
+    free(act->name);
+    free(act->command);
+    free(act->argv);
+    free(act);
+}
+
+static struct instance *findinstance(struct activation *act, pid_t pid) {
+    struct tcpmux_list_item *it;
+    for(it = tcpmux_list_begin(&act->instances); it;
+          it = tcpmux_list_next(it)) {
+        struct instance *inst = cont(it, struct instance, item);
+        if(inst->pid == pid)
+            return inst;
+    }
+    return NULL;
+}
+
+/* Returns pid of the process on the other side of the UNIX connection
+   or -1 if it is not known. */
+static pid_t peerpid(int fd) {
+#if defined SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int rc = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len);
+    if(rc == 0)
+        return cred.pid;
+#endif
+    return -1;
+}
+
+/* Closes all file descriptors except for stdin, stdout and stderr. Doesn't
+   iterate over the whole fd range as it may be huge. */
+static void closefds(void) {
+#if defined SYS_close_range
+    if(syscall(SYS_close_range, 3, ~0U, 0) == 0)
+        return;
+#endif
+    DIR *dir = opendir("/proc/self/fd");
+    if(dir) {
+        struct dirent *entry;
+        while((entry = readdir(dir))) {
+            int fd = atoi(entry->d_name);
+            if(fd > 2 && fd != dirfd(dir))
+                close(fd);
+        }
+        closedir(dir);
+        return;
+    }
+    long maxfd = sysconf(_SC_OPEN_MAX);
+    int fd;
+    for(fd = 3; fd < maxfd; ++fd)
+        close(fd);
+}
+
+static int spawn(struct activation *act) {
+    struct instance *inst = malloc(sizeof(struct instance));
+    if(!inst)
+        return -1;
+    pid_t pid = fork();
+    if(pid < 0) {
+        free(inst);
+        return -1;
+    }
+    if(pid == 0) {
+        /* Don't leak tcpmuxd's sockets to the service. */
+        closefds();
+        execvp(act->argv[0], act->argv);
+        _exit(127);
+    }
+    inst->pid = pid;
+    inst->started = now();
+    inst->state = INSTANCE_RUNNING;
+    inst->deadline = -1;
+    inst->ctl = NULL;
+    tcpmux_list_insert(&act->instances, &inst->item, NULL);
+    ++act->running;
+    return 0;
+}
+
+/* Wakes up the coroutine waiting for the channel, if any. The channel must
+   have a buffer of 1 so that the wakeup is not lost if it is busy. */
+static void wakeup(chan ch) {
+    choose {
+    out(ch, int, 0):
+    otherwise:
+    end
+    }
+}
+
+/* Handles exit of the instance. */
+static void exited(struct activation *act, struct instance *inst) {
+    if(inst->state == INSTANCE_RUNNING) {
+        --act->running;
+        /* Instance that exits right away has most likely failed to
+           start. Back off before trying again. */
+        if(now() - inst->started < TCPMUX_SPAWN_FAILURE_TIME) {
+            ++act->failures;
+            int64_t backoff = TCPMUX_SPAWN_BACKOFF;
+            int i;
+            for(i = 1; i < act->failures &&
+                  backoff < TCPMUX_SPAWN_BACKOFF_MAX; ++i)
+                backoff *= 2;
+            if(backoff > TCPMUX_SPAWN_BACKOFF_MAX)
+                backoff = TCPMUX_SPAWN_BACKOFF_MAX;
+            act->nextspawn = now() + backoff;
+        }
+    }
+    tcpmux_list_erase(&act->instances, &inst->item);
+    free(inst);
+}
+
+static void sigchld(int signo) {
+    int err = errno;
+    char c = 0;
+    ssize_t sz = write(sigchld_pipe[1], &c, 1);
+    (void)sz;
+    errno = err;
+}
+
+/* Collects the instances that have exited. Runs only when SIGCHLD arrives.
+   Only the pids of the instances are waited for so that other children of
+   the process are left alone. */
+static void reaper(void) {
+    while(1) {
+        fdwait(sigchld_pipe[0], FDW_IN, -1);
+        char buf[64];
+        while(read(sigchld_pipe[0], buf, sizeof(buf)) > 0)
+            ;
+        struct tcpmux_list_item *ait;
+        for(ait = tcpmux_list_begin(&activations); ait;
+              ait = tcpmux_list_next(ait)) {
+            struct activation *act = cont(ait, struct activation, item);
+            struct tcpmux_list_item *it = tcpmux_list_begin(&act->instances);
+            int changed = 0;
+            while(it) {
+                struct instance *inst = cont(it, struct instance, item);
+                it = tcpmux_list_next(it);
+                if(waitpid(inst->pid, NULL, WNOHANG) == 0)
+                    continue;
+                exited(act, inst);
+                changed = 1;
+            }
+            if(changed)
+                wakeup(act->wake);
+        }
+    }
+}
+
+/* True if the service keeps failing to start and no new attempt is due. */
+static int failing(struct activation *act) {
+    return act->failures >= TCPMUX_SPAWN_RETRIES && now() < act->nextspawn;
+}
+
+static void rejectfailed(int fd);
+
+/* Starts and stops instances of an activated service as needed. Sleeps
+   until something changes or until the next thing it has to do is due. */
+static void supervisor(struct activation *act) {
+    while(1) {
+        int64_t ddline = -1;
+        /* Keep the warm instances running and start an instance if there's
+           a connection waiting and no instance to handle it. */
+        while(act->running < act->warm || (act->running == 0 && act->pending)) {
+            if(now() < act->nextspawn) {
+                ddline = act->nextspawn;
+                break;
+            }
+            if(spawn(act) != 0) {
+                act->nextspawn = now() + TCPMUX_SPAWN_BACKOFF;
+                ddline = act->nextspawn;
+                break;
+            }
+        }
+        /* Don't keep the connections waiting if the service keeps failing
+           to start. */
+        if(failing(act)) {
+            while(1) {
+                int fd = -1;
+                choose {
+                in(act->ch, int, val):
+                    fd = val;
+                otherwise:
+                end
+                }
+                if(fd == -1)
+                    break;
+                go(rejectfailed(fd));
+            }
+        }
+        /* Ask the surplus instances to drain once there have been no new
+           connections for the idle timeout. */
+        if(act->idle > 0 && act->running > act->warm && !act->pending) {
+            if(now() - act->last >= act->idle) {
+                struct tcpmux_list_item *it;
+                for(it = tcpmux_list_begin(&act->instances);
+                      it && act->running > act->warm;
+                      it = tcpmux_list_next(it)) {
+                    struct instance *inst = cont(it, struct instance, item);
+                    if(inst->state != INSTANCE_RUNNING)
+                        continue;
+                    inst->state = INSTANCE_DRAINING;
+                    inst->deadline = now() + act->idle;
+                    --act->running;
+                    if(inst->ctl)
+                        wakeup(inst->ctl);
+                }
+            }
+            else {
+                int64_t idle = act->last + act->idle;
+                if(ddline < 0 || idle < ddline)
+                    ddline = idle;
+            }
+        }
+        /* Terminate the instances that don't exit by themselves. */
+        struct tcpmux_list_item *it;
+        for(it = tcpmux_list_begin(&act->instances); it;
+              it = tcpmux_list_next(it)) {
+            struct instance *inst = cont(it, struct instance, item);
+            if(inst->deadline < 0)
+                continue;
+            if(now() >= inst->deadline) {
+                if(inst->state == INSTANCE_DRAINING) {
+                    kill(inst->pid, SIGTERM);
+                    inst->state = INSTANCE_TERMINATED;
+                    inst->deadline = now() + TCPMUX_KILL_TIMEOUT;
+                }
+                else {
+                    kill(inst->pid, SIGKILL);
+                    inst->state = INSTANCE_KILLED;
+                    inst->deadline = -1;
+                    continue;
+                }
+            }
+            if(ddline < 0 || inst->deadline < ddline)
+                ddline = inst->deadline;
+        }
+        if(ddline < 0) {
+            chr(act->wake, int);
+            continue;
+        }
+        choose {
+        in(act->wake, int, val):
+        deadline(ddline):
+        end
+        }
+    }
+}
+
+/* Replies to the TCP peer and closes the connection. */
+static void reject(int fd, const char *msg) {
+    tcpsock s = tcpattach(fd, 0);
+    if(!s) {
+        close(fd);
+        return;
+    }
+    tcpsend(s, msg, strlen(msg), -1);
+    if(errno == 0)
+        tcpflush(s, -1);
+    tcpclose(s);
+}
+
+static void rejectfailed(int fd) {
+    reject(fd, "-Service failed to start\r\n");
+}
+
+/* Hands the connection to one of the instances of the activated service.
+   If there's none to take it, the connection is rejected. */
+static void activate(struct activation *act, int fd) {
+    if(failing(act)) {
+        rejectfailed(fd);
+        return;
+    }
+    ++act->pending;
+    wakeup(act->wake);
+    int done = 0;
+    choose {
+    out(act->ch, int, fd):
+        done = 1;
+    deadline(now() + TCPMUX_ACTIVATION_TIMEOUT):
+    end
+    }
+    --act->pending;
+    act->last = now();
+    /* Let the supervisor reschedule the idle timeout. */
+    wakeup(act->wake);
+    if(!done)
+        rejectfailed(fd);
+}
+
 /* The function does no buffering. Any characters past the <CRLF> will
    remain in socket's rx buffer. */
 size_t recvoneline(int fd, char *buf, size_t len) {
@@ -68,52 +498,79 @@ size_t recvoneline(int fd, char *buf, size_t len) {
     return len;
 }
 
+/* Hands the connection to the service. The positive reply is sent to
+   the TCP peer by the unixhandler that takes the connection over. */
+static void dispatch(const char *service, int fd) {
+    /* Services started on demand are looked up in the activation table. */
+    struct activation *act = findactivation(service);
+    if(act) {
+        activate(act, fd);
+        return;
+    }
+    /* Find the registered service. If there are multiple registrations
+       prefer the one pinned to the CPU the connection arrived on. */
+    int cpu = incomingcpu(fd);
+    struct tcpmux_list_item *it;
+    struct service *srvc = NULL;
+    for(it = tcpmux_list_begin(&services); it; it = tcpmux_list_next(it)) {
+        struct service *candidate = cont(it, struct service, item);
+        if(strcmp(service, candidate->name) != 0)
+            continue;
+        if(!srvc)
+            srvc = candidate;
+        if(cpu != -1 && candidate->cpu == cpu) {
+            srvc = candidate;
+            break;
+        }
+    }
+    if(!srvc) {
+        reject(fd, "-Service not found\r\n");
+        return;
+    }
+    if(srvc->cpu != -1 && srvc->cpu != cpu) {
+        /* Move the registration to the end of the list so that
+           the fallback connections are spread among all the workers. */
+        tcpmux_list_erase(&services, &srvc->item);
+        tcpmux_list_insert(&services, &srvc->item, NULL);
+    }
+    /* There's no yield between the lookup and the send, so the registration
+       can't go away in the meantime. */
+    chs(srvc->ch, int, fd);
+}
+
+static void redispatch(char *service, int fd) {
+    dispatch(service, fd);
+    free(service);
+}
+
+/* Hands the connection to a different registration of the service. */
+static void requeue(const char *service, int fd) {
+    char *name = strdup(service);
+    if(!name) {
+        close(fd);
+        return;
+    }
+    go(redispatch(name, fd));
+}
+
 void tcphandler(tcpsock s) {
-    int success = 0;
     /* Get the first line (the service name) from the client. */
     char service[256];
     int fd = tcpdetach(s);
     size_t sz = recvoneline(fd, service, sizeof(service));
     if(errno == ENOBUFS)
-        goto reply;
+        goto notfound;
     assert(errno == 0);
     size_t i;
     for(i = 0; i != sz; ++i) {
         if(service[i] < 32 || service[i] > 127)
-            goto reply;
+            goto notfound;
         service[i] = tolower(service[i]);
     }
-    /* Find the registered service. */
-    struct tcpmux_list_item *it;
-    struct service *srvc;
-    for(it = tcpmux_list_begin(&services); it; it = tcpmux_list_next(it)) {
-        srvc = cont(it, struct service, item);
-        if(strcmp(service, srvc->name) == 0)
-            break;
-    }
-    if(!it)
-        goto reply;
-    success = 1;
-reply:
-    /* Reply to the TCP peer. */
-    s = tcpattach(fd, 0);
-    const char *msg = success ? "+\r\n" : "-Service not found\r\n";
-    tcpsend(s, msg, strlen(msg), -1);
-    if(errno != 0) {
-        tcpclose(s);
-        return;
-    }
-    tcpflush(s, -1);
-    if(errno != 0) {
-        tcpclose(s);
-        return;
-    }
-    if(!success) {
-        tcpclose(s);
-        return;
-    }
-    /* Send the fd to the unixhandler connected to the service in question. */
-    chs(srvc->ch, int, tcpdetach(s));
+    dispatch(service, fd);
+    return;
+notfound:
+    reject(fd, "-Service not found\r\n");
 }
 
 void tcplistener(tcpsock ls) {
@@ -123,6 +580,43 @@ void tcplistener(tcpsock ls) {
     }
 }
 
+/* Sends the fd to the service via UNIX connection. */
+static int sendfd(int fd, int tcpfd) {
+    struct iovec iov;
+    unsigned char buf[] = {0x55};
+    iov.iov_base = buf;
+    iov.iov_len = 1;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char control [sizeof(struct cmsghdr) + 10];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(tcpfd));
+    *((int*)CMSG_DATA(cmsg)) = tcpfd;
+    msg.msg_controllen = cmsg->cmsg_len;
+    while(1) {
+        int rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if(rc == 1)
+            return 0;
+        if(rc != -1 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return -1;
+        fdwait(fd, FDW_OUT, -1);
+    }
+}
+
+/* Wakes up the registration when the service closes the connection. */
+static void watcher(int fd, chan ctl, chan done) {
+    fdwait(fd, FDW_IN, -1);
+    wakeup(ctl);
+    chs(done, int, 0);
+}
+
 void unixhandler(unixsock s) {
     const char *errmsg = NULL;
     /* Get the first line (the service name) from the peer. */
@@ -130,10 +624,25 @@ void unixhandler(unixsock s) {
     int fd = unixdetach(s);
     size_t sz = recvoneline(fd, service, sizeof(service));
     if(errno == ENOBUFS) {
-        const char *errmsg = "-1: Service name too long\r\n";
+        errmsg = "-1: Service name too long\r\n";
         goto reply;
     }
     assert(errno == 0);
+    /* Service name may be followed by a tab and the CPU the service is
+       pinned to. Tab can't be a part of the service name. */
+    int cpu = -1;
+    char *sep = strchr(service, '\t');
+    if(sep) {
+        char *endp;
+        long val = strtol(sep + 1, &endp, 10);
+        if(endp == sep + 1 || *endp != 0 || val < 0 || val > INT_MAX) {
+            errmsg = "-4: Invalid CPU\r\n";
+            goto reply;
+        }
+        cpu = (int)val;
+        *sep = 0;
+        sz = sep - service;
+    }
     size_t i;
     for(i = 0; i != sz; ++i) {
         if(service[i] < 32 || service[i] > 127) {
@@ -142,19 +651,36 @@ void unixhandler(unixsock s) {
         }
         service[i] = tolower(service[i]);
     }
-    /* Check whether the service is already registered. */
+    /* Instances of an activated service share the activation's channel
+       and there can be any number of them. */
+    struct activation *act = findactivation(service);
+    struct service self;
+    if(act) {
+        if(cpu != -1) {
+            errmsg = "-5: Activated service can't be pinned to a CPU\r\n";
+            goto reply;
+        }
+        /* The service has started successfully. */
+        act->failures = 0;
+        errmsg = "+\r\n";
+        goto reply;
+    }
+    /* Check whether the service is already registered. Multiple
+       registrations are allowed only if all of them are pinned to
+       distinct CPUs. */
     struct tcpmux_list_item *it;
     for(it = tcpmux_list_begin(&services); it; it = tcpmux_list_next(it)) {
         struct service *srvc = cont(it, struct service, item);
-        if(strcmp(service, srvc->name) == 0)
+        if(strcmp(service, srvc->name) == 0 &&
+              (cpu == -1 || srvc->cpu == -1 || srvc->cpu == cpu))
             break;
     }
     if(it) {
         errmsg = "-3: Service already exists\r\n";
         goto reply;
     }
-    struct service self;
     self.name = service;
+    self.cpu = cpu;
     self.ch = chmake(int, 0);
     assert(self.ch);
     tcpmux_list_insert(&services, &self.item, NULL);
@@ -176,35 +702,197 @@ reply:
         unixclose(s);
         return;
     }
-    if(errmsg[0] == '-')
-       return;
+    if(errmsg[0] == '-') {
+        unixclose(s);
+        return;
+    }
     /* Wait for new incoming connections. Send them to the service. */
     fd = unixdetach(s);
+    chan ctl = chmake(int, 1);
+    assert(ctl);
+    chan done = chmake(int, 0);
+    assert(done);
+    go(watcher(fd, ctl, done));
+    pid_t pid = -1;
+    if(act) {
+        pid = peerpid(fd);
+        struct instance *inst = findinstance(act, pid);
+        if(inst)
+            inst->ctl = ctl;
+    }
+    int tcpfd;
     while(1) {
-        int tcpfd = chr(self.ch, int);
-        /* Send the fd to the serivce via UNIX connection. */
-        struct iovec iov;
-        unsigned char buf[] = {0x55};
-        iov.iov_base = buf;
-        iov.iov_len = 1;
-        struct msghdr msg;
-        memset(&msg, 0, sizeof (msg));
-        msg.msg_iov = &iov;
-        msg.msg_iovlen = 1;
-        char control [sizeof(struct cmsghdr) + 10];
-        msg.msg_control = control;
-        msg.msg_controllen = sizeof(control);
-        struct cmsghdr *cmsg;
-        cmsg = CMSG_FIRSTHDR(&msg);
-        cmsg->cmsg_level = SOL_SOCKET;
-        cmsg->cmsg_type = SCM_RIGHTS;
-        cmsg->cmsg_len = CMSG_LEN(sizeof(tcpfd));
-        *((int*)CMSG_DATA(cmsg)) = tcpfd;
-        msg.msg_controllen = cmsg->cmsg_len;
-        int rc = sendmsg(fd, &msg, 0);
-        if (rc != 1)
+        tcpfd = -1;
+        /* Instance that is shutting down gets no new connections. */
+        struct instance *inst = act ? findinstance(act, pid) : NULL;
+        if(inst && inst->state != INSTANCE_RUNNING)
+            break;
+        choose {
+        in(act ? act->ch : self.ch, int, val):
+            tcpfd = val;
+        in(ctl, int, wake):
+        end
+        }
+        /* The service never sends anything after the registration.
+           If the socket is readable, the service has exited. */
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if(poll(&pfd, 1, 0) != 0)
+            break;
+        inst = act ? findinstance(act, pid) : NULL;
+        if(inst && inst->state != INSTANCE_RUNNING)
+            break;
+        if(tcpfd == -1)
+            continue;
+        if(send(tcpfd, "+\r\n", 3, MSG_NOSIGNAL) != 3) {
+            close(tcpfd);
+            continue;
+        }
+        if(sendfd(fd, tcpfd) == 0) {
+            countdispatch(act ? -1 : self.cpu, tcpfd);
             close(tcpfd);
+            continue;
+        }
+        /* The peer has already been told that the service exists. */
+        close(tcpfd);
+        tcpfd = -1;
+        break;
+    }
+    /* Stop the watcher. Closing the connection tells the service that it
+       will get no more connections. */
+    if(act) {
+        struct instance *inst = findinstance(act, pid);
+        if(inst && inst->ctl == ctl)
+            inst->ctl = NULL;
+    }
+    shutdown(fd, SHUT_RDWR);
+    chr(done, int);
+    chclose(done);
+    chclose(ctl);
+    /* The service is gone. Pass the connections that were meant for it
+       to a different registration of the service. */
+    if(act) {
+        if(tcpfd != -1)
+            requeue(service, tcpfd);
+    }
+    else {
+        tcpmux_list_erase(&services, &self.item);
+        if(tcpfd != -1)
+            requeue(service, tcpfd);
+        while(1) {
+            tcpfd = -1;
+            choose {
+            in(self.ch, int, val):
+                tcpfd = val;
+            otherwise:
+            end
+            }
+            if(tcpfd == -1)
+                break;
+            requeue(service, tcpfd);
+        }
+        chclose(self.ch);
     }
+    close(fd);
+}
+
+int tcpmuxdconfig(const char *fname) {
+    FILE *f = fopen(fname, "r");
+    if(!f)
+        return -1;
+    /* Nothing is loaded unless the whole file is valid. */
+    struct tcpmux_list loaded = {0};
+    struct tcpmux_list_item *it;
+    char line[1024];
+    while(fgets(line, sizeof(line), f)) {
+        size_t len = strlen(line);
+        while(len > 0 && isspace((unsigned char)line[len - 1]))
+            line[--len] = 0;
+        char *ln = line;
+        while(isspace((unsigned char)*ln))
+            ++ln;
+        if(*ln == 0 || *ln == '#')
+            continue;
+        /* <service> <idle-timeout> <warm-instances> <command> */
+        char name[256];
+        long long idle;
+        int warm;
+        int pos = 0;
+        int rc = sscanf(ln, "%255s %lld %d %n", name, &idle, &warm, &pos);
+        if(rc != 3 || pos == 0 || ln[pos] == 0 || idle < 0 || warm < 0)
+            goto einval;
+        size_t i;
+        for(i = 0; name[i]; ++i) {
+            if(name[i] < 32 || name[i] > 127)
+                goto einval;
+            name[i] = tolower(name[i]);
+        }
+        if(findactivation(name) || lookupactivation(&loaded, name))
+            goto einval;
+        struct activation *act = malloc(sizeof(struct activation));
+        if(!act)
+            goto enomem;
+        act->name = strdup(name);
+        act->command = strdup(ln + pos);
+        act->argv = NULL;
+        if(act->name && act->command) {
+            /* Split the command into arguments at whitespace. */
+            size_t argc = 0;
+            char *arg;
+            for(arg = strtok(act->command, " \t"); arg;
+                  arg = strtok(NULL, " \t")) {
+                char **argv = realloc(act->argv, (argc + 2) * sizeof(char*));
+                if(!argv)
+                    break;
+                act->argv = argv;
+                act->argv[argc++] = arg;
+                act->argv[argc] = NULL;
+            }
+        }
+        if(!act->name || !act->command || !act->argv) {
+            freeactivation(act);
+            goto enomem;
+        }
+        act->idle = idle;
+        act->warm = warm;
+        act->ch = chmake(int, 0);
+        assert(act->ch);
+        act->wake = chmake(int, 1);
+        assert(act->wake);
+        act->pending = 0;
+        act->last = now();
+        act->failures = 0;
+        act->nextspawn = 0;
+        tcpmux_list_init(&act->instances);
+        act->running = 0;
+        tcpmux_list_insert(&loaded, &act->item, NULL);
+    }
+    fclose(f);
+    while((it = tcpmux_list_begin(&loaded))) {
+        tcpmux_list_erase(&loaded, it);
+        tcpmux_list_insert(&activations, it, NULL);
+    }
+    return 0;
+einval:
+    errno = EINVAL;
+    goto error;
+enomem:
+    errno = ENOMEM;
+error:;
+    int err = errno;
+    fclose(f);
+    while((it = tcpmux_list_begin(&loaded))) {
+        tcpmux_list_erase(&loaded, it);
+        freeactivation(cont(it, struct activation, item));
+    }
+    errno = err;
+    return -1;
+}
+
+void tcpmuxdstats(uint64_t *local, uint64_t *remote) {
+    if(local)
+        *local = dispatch_local;
+    if(remote)
+        *remote = dispatch_remote;
 }
 
 int tcpmuxd(ipaddr addr) {
@@ -224,6 +912,29 @@ int tcpmuxd(ipaddr addr) {
         tcpclose(ls);
         return -1;
     }
+    /* Start the warm instances of activated services. Exited instances are
+       collected when SIGCHLD arrives. */
+    struct tcpmux_list_item *it;
+    if(!tcpmux_list_empty(&activations)) {
+        int rc = pipe(sigchld_pipe);
+        if(rc != 0) {
+            unixclose(us);
+            tcpclose(ls);
+            return -1;
+        }
+        fcntl(sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = sigchld;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+        rc = sigaction(SIGCHLD, &sa, NULL);
+        assert(rc == 0);
+        go(reaper());
+    }
+    for(it = tcpmux_list_begin(&activations); it; it = tcpmux_list_next(it))
+        go(supervisor(cont(it, struct activation, item)));
     /* Start accepting TCP connections from clients. */
     go(tcplistener(ls));
     /* Process new registrations as they arrive. */
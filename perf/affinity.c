@@ -0,0 +1,258 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+/* Measures the effect of CPU-affine dispatch on loopback round-trip latency.
+   There's one echo worker and one client process pinned to each CPU.
+   In the 'local' run each worker registers for the CPU it runs on. In the
+   'remote' run it registers for the neighbouring CPU so that every
+   connection is handed over to a worker on a different CPU than the one
+   that processed its packets. */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <libmill.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../tcpmux.h"
+
+#define PORT 5558
+
+static int64_t nanonow(void) {
+    struct timespec ts;
+    int rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+    assert(rc == 0);
+    return ((int64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rc = sched_setaffinity(0, sizeof(set), &set);
+    assert(rc == 0);
+}
+
+static void echo(tcpsock s) {
+    char buf[1];
+    while(1) {
+        tcprecv(s, buf, sizeof(buf), -1);
+        if(errno != 0)
+            break;
+        tcpsend(s, buf, sizeof(buf), -1);
+        if(errno != 0)
+            break;
+        tcpflush(s, -1);
+        if(errno != 0)
+            break;
+    }
+    tcpclose(s);
+}
+
+static void worker(const char *service, int cpu, int regcpu) {
+    pin(cpu);
+    tcpmuxsock ls;
+    while(1) {
+        ls = tcpmuxlistencpu(PORT, service, regcpu, -1);
+        if(ls)
+            break;
+        msleep(now() + 100);
+    }
+    while(1) {
+        tcpsock s = tcpmuxaccept(ls, -1);
+        assert(s);
+        go(echo(s));
+    }
+}
+
+/* Writes average roundtrip latency in nanoseconds to 'resfd'. */
+static void client(const char *service, int cpu, int conns, int roundtrips,
+      int startfd, int resfd) {
+    pin(cpu);
+    /* Wait till it's this run's turn. */
+    char c;
+    ssize_t sz = read(startfd, &c, 1);
+    assert(sz == 1);
+    ipaddr addr = ipremote("127.0.0.1", PORT, 0, -1);
+    int64_t total = 0;
+    int i, j;
+    for(i = 0; i != conns; ++i) {
+        tcpsock s = tcpmuxconnect(addr, service, -1);
+        assert(s);
+        int64_t start = nanonow();
+        for(j = 0; j != roundtrips; ++j) {
+            char buf[1] = {'a'};
+            tcpsend(s, buf, sizeof(buf), -1);
+            assert(errno == 0);
+            tcpflush(s, -1);
+            assert(errno == 0);
+            tcprecv(s, buf, sizeof(buf), -1);
+            assert(errno == 0);
+        }
+        total += nanonow() - start;
+        tcpclose(s);
+    }
+    int64_t avg = total / ((int64_t)conns * roundtrips);
+    sz = write(resfd, &avg, sizeof(avg));
+    assert(sz == sizeof(avg));
+}
+
+static void muxdaemon(void) {
+    tcpmuxd(iplocal(NULL, PORT, 0));
+    assert(0);
+}
+
+struct run {
+    const char *service;
+    /* Each worker registers for the CPU this many CPUs away from its own. */
+    int shift;
+    int startfd[2];
+    int resfd[2];
+    pid_t *clients;
+    int64_t latency;
+    uint64_t local;
+    uint64_t remote;
+};
+
+/* All the processes are forked before tcpmuxd is started in this process.
+   The clients of each run wait for the parent to let them go. */
+static void prepare(struct run *r, int ncpus, int conns, int roundtrips,
+      pid_t *workers) {
+    int rc = pipe(r->startfd);
+    assert(rc == 0);
+    rc = pipe(r->resfd);
+    assert(rc == 0);
+    int i;
+    for(i = 0; i != ncpus; ++i) {
+        workers[i] = mfork();
+        assert(workers[i] >= 0);
+        if(workers[i] == 0) {
+            worker(r->service, i, (i + r->shift) % ncpus);
+            exit(0);
+        }
+    }
+    r->clients = malloc(ncpus * sizeof(pid_t));
+    assert(r->clients);
+    for(i = 0; i != ncpus; ++i) {
+        r->clients[i] = mfork();
+        assert(r->clients[i] >= 0);
+        if(r->clients[i] == 0) {
+            client(r->service, i, conns, roundtrips, r->startfd[0],
+                r->resfd[1]);
+            exit(0);
+        }
+    }
+}
+
+static void execute(struct run *r, int ncpus) {
+    uint64_t local1, remote1;
+    tcpmuxdstats(&local1, &remote1);
+    char start[256];
+    memset(start, 0, sizeof(start));
+    int i;
+    for(i = 0; i < ncpus; i += sizeof(start)) {
+        size_t len = ncpus - i < (int)sizeof(start) ? ncpus - i : sizeof(start);
+        ssize_t sz = write(r->startfd[1], start, len);
+        assert(sz == (ssize_t)len);
+    }
+    int running = ncpus;
+    while(running) {
+        running = 0;
+        for(i = 0; i != ncpus; ++i) {
+            if(r->clients[i] == -1)
+                continue;
+            if(waitpid(r->clients[i], NULL, WNOHANG) == 0) {
+                ++running;
+                continue;
+            }
+            r->clients[i] = -1;
+        }
+        if(running)
+            msleep(now() + 10);
+    }
+    int64_t total = 0;
+    for(i = 0; i != ncpus; ++i) {
+        int64_t avg;
+        ssize_t sz = read(r->resfd[0], &avg, sizeof(avg));
+        assert(sz == sizeof(avg));
+        total += avg;
+    }
+    r->latency = total / ncpus;
+    uint64_t local2, remote2;
+    tcpmuxdstats(&local2, &remote2);
+    r->local = local2 - local1;
+    r->remote = remote2 - remote1;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 3) {
+        fprintf(stderr, "usage: affinity <connections> <roundtrips>\n");
+        return 1;
+    }
+    int conns = atoi(argv[1]);
+    int roundtrips = atoi(argv[2]);
+    int ncpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    assert(ncpus > 0);
+    if(ncpus < 2)
+        fprintf(stderr, "warning: single CPU, dispatch is always local\n");
+
+    struct run runs[2] = {{"affinity-local", 0}, {"affinity-remote", 1}};
+    pid_t *workers = malloc(2 * ncpus * sizeof(pid_t));
+    assert(workers);
+    prepare(&runs[0], ncpus, conns, roundtrips, workers);
+    prepare(&runs[1], ncpus, conns, roundtrips, workers + ncpus);
+
+    /* Give the workers time to register before the first run. */
+    go(muxdaemon());
+    msleep(now() + 1000);
+    int i;
+    for(i = 0; i != 2; ++i) {
+        execute(&runs[i], ncpus);
+        printf("%-6s %8ld ns per roundtrip  (%llu local, %llu remote)\n",
+            i == 0 ? "local" : "remote", (long)runs[i].latency,
+            (unsigned long long)runs[i].local,
+            (unsigned long long)runs[i].remote);
+    }
+    if(runs[0].latency > 0)
+        printf("remote/local latency ratio: %.2f\n",
+            (double)runs[1].latency / runs[0].latency);
+
+    for(i = 0; i != 2 * ncpus; ++i) {
+        kill(workers[i], SIGTERM);
+        waitpid(workers[i], NULL, 0);
+    }
+    free(runs[1].clients);
+    free(runs[0].clients);
+    free(workers);
+    return 0;
+}
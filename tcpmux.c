@@ -41,6 +41,11 @@ struct tcpmuxsock {
 };
 
 tcpmuxsock tcpmuxlisten(int port, const char *service, int64_t deadline) {
+    return tcpmuxlistencpu(port, service, -1, deadline);
+}
+
+tcpmuxsock tcpmuxlistencpu(int port, const char *service, int cpu,
+    int64_t deadline) {
     /* Connect to tcpmuxd. */
     char fname[64];
     snprintf(fname, sizeof(fname), "/tmp/tcpmuxd.%d", port);
@@ -51,6 +56,13 @@ tcpmuxsock tcpmuxlisten(int port, const char *service, int64_t deadline) {
     unixsend(s, service, strlen(service), deadline);
     if(errno != 0)
         goto error;
+    if(cpu != -1) {
+        char buf[16];
+        int len = snprintf(buf, sizeof(buf), "\t%d", cpu);
+        unixsend(s, buf, len, deadline);
+        if(errno != 0)
+            goto error;
+    }
     unixsend(s, "\r\n", 2, deadline);
     if(errno != 0)
         goto error;
@@ -64,7 +76,7 @@ tcpmuxsock tcpmuxlisten(int port, const char *service, int64_t deadline) {
         goto error;
     if(reply[0] != '+') {
         unixclose(s);
-        errno = EADDRINUSE; /* TODO: There are multiple reasons... */
+        errno = strncmp(reply, "-3:", 3) == 0 ? EADDRINUSE : EINVAL;
         return NULL;
     }
 
@@ -26,6 +26,7 @@
 #define TCPMUX_H_INCLUDED
 
 #include <libmill.h>
+#include <stdint.h>
 
 /******************************************************************************/
 /*  ABI versioning support                                                    */
@@ -78,11 +79,15 @@ typedef struct tcpmuxsock *tcpmuxsock;
 
 TCPMUX_EXPORT tcpmuxsock tcpmuxlisten(int port, const char *service,
     int64_t deadline);
+TCPMUX_EXPORT tcpmuxsock tcpmuxlistencpu(int port, const char *service,
+    int cpu, int64_t deadline);
 TCPMUX_EXPORT tcpsock tcpmuxaccept(tcpmuxsock s, int64_t deadline);
 TCPMUX_EXPORT tcpsock tcpmuxconnect(ipaddr addr, const char *service,
     int64_t deadline);
 TCPMUX_EXPORT void tcpmuxclose(tcpmuxsock s);
+TCPMUX_EXPORT int tcpmuxdconfig(const char *fname);
 TCPMUX_EXPORT int tcpmuxd(ipaddr addr);
+TCPMUX_EXPORT void tcpmuxdstats(uint64_t *local, uint64_t *remote);
 
 #endif
 
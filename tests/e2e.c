@@ -22,12 +22,26 @@
 
 */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
 #include <libmill.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "../tcpmux.h"
 
-void daemon(void) {
+static void muxdaemon(void) {
     tcpmuxd(iplocal(NULL, 5557, 0));
     assert(0);
 }
@@ -42,8 +56,110 @@ void doconnect(void) {
     assert(errno == 0);
 }
 
-int main(void) {
-    go(daemon());
+static int64_t monotonic(void) {
+    struct timespec ts;
+    int rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+    assert(rc == 0);
+    return ((int64_t)ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Instance of an activated service started by tcpmuxd. Replies to each
+   connection with its pid and the time it has registered. If 'stubborn'
+   is set, it doesn't exit when tcpmuxd stops sending it connections and
+   it ignores SIGTERM. */
+static int serve(const char *service, int stubborn) {
+    tcpmuxsock ls = tcpmuxlisten(5557, service, -1);
+    if(!ls)
+        return 1;
+    int64_t registered = monotonic();
+    while(1) {
+        tcpsock s = tcpmuxaccept(ls, -1);
+        if(!s && stubborn) {
+            signal(SIGTERM, SIG_IGN);
+            while(1)
+                pause();
+        }
+        if(!s)
+            return 1;
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "%d %lld\n", (int)getpid(),
+            (long long)registered);
+        tcpsend(s, buf, len, -1);
+        if(errno == 0)
+            tcpflush(s, -1);
+        tcpclose(s);
+    }
+}
+
+/* Connects to the activated service and returns the instance's pid. */
+static pid_t activated(const char *service, int64_t *registered) {
+    ipaddr addr = ipremote("127.0.0.1", 5557, 0, -1);
+    tcpsock s = tcpmuxconnect(addr, service, -1);
+    assert(s);
+    char buf[64];
+    size_t sz = tcprecvuntil(s, buf, sizeof(buf) - 1, "\n", 1, -1);
+    assert(errno == 0);
+    buf[sz] = 0;
+    tcpclose(s);
+    int pid;
+    long long reg;
+    int rc = sscanf(buf, "%d %lld", &pid, &reg);
+    assert(rc == 2);
+    *registered = reg;
+    return pid;
+}
+
+static void writeconfig(char *fname, const char *config) {
+    strcpy(fname, "/tmp/tcpmux-e2e.XXXXXX");
+    int fd = mkstemp(fname);
+    assert(fd != -1);
+    ssize_t sz = write(fd, config, strlen(config));
+    assert(sz == (ssize_t)strlen(config));
+    close(fd);
+}
+
+static void badconfig(const char *config) {
+    char fname[32];
+    writeconfig(fname, config);
+    int rc = tcpmuxdconfig(fname);
+    assert(rc == -1 && errno == EINVAL);
+    unlink(fname);
+}
+
+int main(int argc, char *argv[]) {
+    if(argc >= 3 && strcmp(argv[1], "serve") == 0)
+        return serve(argv[2], argc == 4 && strcmp(argv[3], "stubborn") == 0);
+
+    /* Malformed activation tables are rejected. */
+    badconfig("lazy 0 0\n");
+    badconfig("lazy 0 -1 /bin/true\n");
+    badconfig("lazy -1 0 /bin/true\n");
+    badconfig("lazy x 0 /bin/true\n");
+    badconfig("lazy 0 0 /bin/true\nlazy 0 0 /bin/true\n");
+    badconfig("stale 0 0 /bin/true\nlazy 0 -1 /bin/true\n");
+    int rc = tcpmuxdconfig("/nonexistent/tcpmux.conf");
+    assert(rc == -1 && errno == ENOENT);
+
+    /* Services started on demand are served by this program itself. */
+    char self[PATH_MAX];
+    char *path = realpath(argv[0], self);
+    assert(path);
+    char config[4 * PATH_MAX];
+    snprintf(config, sizeof(config),
+        "# service idle warm command\n"
+        "\n"
+        "lazy 300 0 %s serve lazy\n"
+        "warm 0 1 %s serve warm\n"
+        "stubborn 200 0 %s serve stubborn stubborn\n"
+        "broken 0 0 /nonexistent/command\n",
+        self, self, self);
+    char fname[32];
+    writeconfig(fname, config);
+    rc = tcpmuxdconfig(fname);
+    assert(rc == 0);
+    unlink(fname);
+
+    go(muxdaemon());
     msleep(now() + 500);
     tcpmuxsock ls = tcpmuxlisten(5557, "foo", -1);
     assert(ls);
@@ -57,5 +173,116 @@ int main(void) {
     tcpclose(s);
     tcpmuxclose(ls);
 
+    /* Multiple registrations pinned to distinct CPUs can share the service
+       name. Unpinned registration of the same name is rejected. */
+    int cpu = 0;
+#if defined HAVE_SCHED_SETAFFINITY && defined SO_INCOMING_CPU
+    /* On loopback the connection arrives on the sender's CPU. Pin the test
+       to a single CPU so that the incoming CPU is known. */
+    cpu_set_t set;
+    rc = sched_getaffinity(0, sizeof(set), &set);
+    assert(rc == 0);
+    while(!CPU_ISSET(cpu, &set))
+        ++cpu;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    rc = sched_setaffinity(0, sizeof(set), &set);
+    assert(rc == 0);
+#endif
+    tcpmuxsock ls1 = tcpmuxlistencpu(5557, "bar", cpu, -1);
+    assert(ls1);
+    tcpmuxsock ls2 = tcpmuxlistencpu(5557, "bar", cpu + 1, -1);
+    assert(ls2);
+    tcpmuxsock ls3 = tcpmuxlisten(5557, "bar", -1);
+    assert(!ls3 && errno == EADDRINUSE);
+    ls3 = tcpmuxlistencpu(5557, "bar", cpu + 1, -1);
+    assert(!ls3 && errno == EADDRINUSE);
+    ls3 = tcpmuxlistencpu(5557, "baz", -5, -1);
+    assert(!ls3 && errno == EINVAL);
+    ls3 = tcpmuxlisten(5557, "baz", -1);
+    assert(ls3);
+    tcpmuxclose(ls3);
+
+    /* The connection is handed to the registration pinned to the CPU
+       it has arrived on. */
+    uint64_t local1, remote1;
+    tcpmuxdstats(&local1, &remote1);
+    ipaddr addr = ipremote("127.0.0.1", 5557, 0, -1);
+    tcpsock cs = tcpmuxconnect(addr, "bar", -1);
+    assert(cs);
+    uint64_t local2, remote2;
+    tcpmuxdstats(&local2, &remote2);
+    tcpsock s1 = tcpmuxaccept(ls1, now() + 100);
+    tcpsock s2 = tcpmuxaccept(ls2, now() + 100);
+#if defined HAVE_SCHED_SETAFFINITY && defined SO_INCOMING_CPU
+    assert(s1 && !s2);
+    assert(local2 == local1 + 1 && remote2 == remote1);
+#else
+    /* Incoming CPU isn't known. The connection goes to one of them. */
+    assert((s1 && !s2) || (!s1 && s2));
+    assert(local2 + remote2 <= local1 + remote1 + 1);
+#endif
+    tcpclose(s1 ? s1 : s2);
+    tcpclose(cs);
+
+    /* Registration of a worker that has exited is removed. */
+    tcpmuxclose(ls1);
+    msleep(now() + 300);
+    ls1 = tcpmuxlistencpu(5557, "bar", cpu, -1);
+    assert(ls1);
+    tcpmuxclose(ls2);
+    tcpmuxclose(ls1);
+
+    /* Service names may contain spaces. */
+    ls = tcpmuxlisten(5557, "my service", -1);
+    assert(ls);
+    cs = tcpmuxconnect(addr, "my service", -1);
+    assert(cs);
+    s = tcpmuxaccept(ls, -1);
+    assert(s);
+    tcpclose(s);
+    tcpclose(cs);
+    tcpmuxclose(ls);
+
+    /* Warm instance is started together with tcpmuxd. */
+    int64_t start = monotonic();
+    int64_t registered;
+    pid_t pid = activated("warm", &registered);
+    assert(registered < start);
+
+    /* Instance is started by the first connection. The connection is held
+       until the instance registers. */
+    start = monotonic();
+    pid = activated("lazy", &registered);
+    assert(registered >= start);
+    assert(activated("lazy", &registered) == pid);
+
+    /* Instance is asked to drain once the service goes idle. It exits when
+       tcpmuxd closes its registration. */
+    msleep(now() + 1000);
+    assert(kill(pid, 0) == -1 && errno == ESRCH);
+    assert(activated("lazy", &registered) != pid);
+
+    /* Instance that doesn't exit after the drain period and ignores SIGTERM
+       gets SIGKILL. */
+    pid = activated("stubborn", &registered);
+    msleep(now() + 2500);
+    assert(kill(pid, 0) == 0);
+    msleep(now() + 5000);
+    assert(kill(pid, 0) == -1 && errno == ESRCH);
+
+    /* Nothing from a malformed activation table is loaded. */
+    ls = tcpmuxlistencpu(5557, "stale", 0, -1);
+    assert(ls);
+    tcpmuxclose(ls);
+
+    /* Activated service can't be pinned to a CPU. */
+    ls = tcpmuxlistencpu(5557, "lazy", 0, -1);
+    assert(!ls && errno == EINVAL);
+
+    /* Connection is rejected if the service fails to start. */
+    cs = tcpmuxconnect(addr, "broken", -1);
+    assert(!cs && errno == ECONNREFUSED);
+
     return 0;
 }